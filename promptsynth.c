@@ -1,34 +1,420 @@
 #include "promptsynth.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <git2.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Maps `path` read-only. Empty files cannot be mapped, they are returned
+/// with `data` set to NULL and `len` set to 0.
+int map_file(const char* path, mapped_file* mf) {
+  struct stat st;
+  mf->data = NULL;
+  mf->len = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    mf->data = (const char*)data;
+    mf->len = st.st_size;
+  }
+  close(fd);
+  return 0;
+}
+
+void unmap_file(mapped_file* mf) {
+  if (mf->data != NULL) {
+    munmap((void*)mf->data, mf->len);
+  }
+  mf->data = NULL;
+  mf->len = 0;
+}
+
+/// Returns a copy of the first line of `path`, after stripping `prefix` and
+/// trailing whitespace. Used for `.git` files of worktrees and `commondir`.
+char* read_first_line(const char* path, const char* prefix) {
+  mapped_file mf;
+  size_t prefix_len = strlen(prefix);
+  char* result = NULL;
+  if (map_file(path, &mf) != 0) {
+    return NULL;
+  }
+  if (mf.len >= prefix_len && memcmp(mf.data, prefix, prefix_len) == 0) {
+    const char* start = mf.data + prefix_len;
+    const char* end = start;
+    while (end < mf.data + mf.len && *end != '\n') {
+      end++;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+      end--;
+    }
+    result = strndup(start, end - start);
+  }
+  unmap_file(&mf);
+  return result;
+}
+
+/// Makes `path` absolute relative to `base` if it is not already.
+char* resolve_relative_path(const char* base, char* path) {
+  char* joined;
+  if (path == NULL || path[0] == '/') {
+    return path;
+  }
+  asprintf(&joined, "%s/%s", base, path);
+  free(path);
+  return joined;
+}
+
+int is_gitdir(const char* dir) {
+  char* path;
+  struct stat st;
+  int found;
+  asprintf(&path, "%s/HEAD", dir);
+  found = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+  free(path);
+  if (!found) {
+    return 0;
+  }
+  asprintf(&path, "%s/objects", dir);
+  found = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+  free(path);
+  if (!found) {
+    // linked worktrees keep objects in the common dir
+    asprintf(&path, "%s/commondir", dir);
+    found = stat(path, &st) == 0;
+    free(path);
+  }
+  return found;
+}
+
+/// discover_repo_paths walks up from `path` looking for a `.git` directory or
+/// file, like git_repository_discover does, but without touching libgit2.
+/// Discovery stops at filesystem boundaries. Returns PS_ENOTAREPO if no
+/// repository is found.
+int discover_repo_paths(const char* path, ps_repo_paths* paths) {
+  struct stat st;
+  dev_t start_dev;
+  memset((void*)paths, 0, sizeof(ps_repo_paths));
+  char* dir = realpath(path, NULL);
+  if (dir == NULL || stat(dir, &st) != 0) {
+    free(dir);
+    return PS_ENOTAREPO;
+  }
+  start_dev = st.st_dev;
+  for (;;) {
+    char* dotgit;
+    asprintf(&dotgit, "%s/.git", dir);
+    if (stat(dotgit, &st) == 0) {
+      if (S_ISDIR(st.st_mode) && is_gitdir(dotgit)) {
+        paths->gitdir = dotgit;
+        paths->workdir = dir;
+        break;
+      } else if (S_ISREG(st.st_mode)) {
+        char* target = resolve_relative_path(
+            dir, read_first_line(dotgit, "gitdir: "));
+        if (target != NULL && is_gitdir(target)) {
+          free(dotgit);
+          paths->gitdir = target;
+          paths->workdir = dir;
+          break;
+        }
+        free(target);
+      }
+    }
+    free(dotgit);
+    if (is_gitdir(dir)) {
+      paths->gitdir = dir;
+      break;
+    }
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL || dir[1] == '\0') {
+      free(dir);
+      return PS_ENOTAREPO;
+    }
+    slash[slash == dir ? 1 : 0] = '\0';
+    if (stat(dir, &st) != 0 || st.st_dev != start_dev) {
+      free(dir);
+      return PS_ENOTAREPO;
+    }
+  }
+
+  char* commondir_file;
+  asprintf(&commondir_file, "%s/commondir", paths->gitdir);
+  paths->commondir = resolve_relative_path(
+      paths->gitdir, read_first_line(commondir_file, ""));
+  free(commondir_file);
+  if (paths->commondir == NULL) {
+    paths->commondir = strdup(paths->gitdir);
+  }
+  return 0;
+}
+
+void free_repo_paths(ps_repo_paths* paths) {
+  free(paths->gitdir);
+  free(paths->commondir);
+  free(paths->workdir);
+  memset((void*)paths, 0, sizeof(ps_repo_paths));
+}
+
+/// Copies the leading hex object id of `data` into `oid_hex`.
+int copy_oid_hex(const char* data, size_t len, char* oid_hex) {
+  size_t n = 0;
+  while (n < len && n < MAX_OID_HEX_LEN && isxdigit((unsigned char)data[n])) {
+    oid_hex[n] = data[n];
+    n++;
+  }
+  oid_hex[n] = '\0';
+  return n >= 40 ? 0 : -1;
+}
+
+/// Strips the `refs/heads/` prefix of local branches.
+const char* ref_shorthand(const char* refname) {
+  if (strncmp(refname, "refs/heads/", 11) == 0) {
+    return refname + 11;
+  }
+  return refname;
+}
+
+/// Reads HEAD of the worktree. If it is a symbolic ref, `*ref_out` is set to
+/// a copy of the target ref name; otherwise it is left NULL and the detached
+/// object id is copied to `oid_hex`, if given.
+int read_head(const ps_repo_paths* paths, char** ref_out, char* oid_hex) {
+  char* path;
+  mapped_file mf;
+  int result = -1;
+  *ref_out = NULL;
+  asprintf(&path, "%s/HEAD", paths->gitdir);
+  int map_result = map_file(path, &mf);
+  free(path);
+  if (map_result != 0) {
+    return -1;
+  }
+  if (mf.len > 5 && memcmp(mf.data, "ref: ", 5) == 0) {
+    const char* end = memchr(mf.data, '\n', mf.len);
+    if (end == NULL) {
+      end = mf.data + mf.len;
+    }
+    *ref_out = strndup(mf.data + 5, end - (mf.data + 5));
+    result = 0;
+  } else if (oid_hex != NULL) {
+    result = copy_oid_hex(mf.data, mf.len, oid_hex);
+  }
+  unmap_file(&mf);
+  return result;
+}
+
+/// Looks `refname` up in `packed-refs`. Peeled lines (`^...`) and the header
+/// are skipped.
+int read_packed_ref_oid(const ps_repo_paths* paths,
+                        const char* refname,
+                        char* oid_hex) {
+  char* path;
+  mapped_file mf;
+  int result = -1;
+  size_t name_len = strlen(refname);
+  asprintf(&path, "%s/packed-refs", paths->commondir);
+  int map_result = map_file(path, &mf);
+  free(path);
+  if (map_result != 0) {
+    return -1;
+  }
+  const char* line = mf.data;
+  const char* end = mf.data + mf.len;
+  while (line != NULL && line < end) {
+    const char* eol = memchr(line, '\n', end - line);
+    const char* line_end = eol != NULL ? eol : end;
+    const char* space = memchr(line, ' ', line_end - line);
+    if (line[0] != '#' && line[0] != '^' && space != NULL &&
+        (size_t)(line_end - space - 1) == name_len &&
+        memcmp(space + 1, refname, name_len) == 0) {
+      result = copy_oid_hex(line, space - line, oid_hex);
+      break;
+    }
+    line = eol != NULL ? eol + 1 : NULL;
+  }
+  unmap_file(&mf);
+  return result;
+}
+
+/// Resolves `refname` to the object id it points at, following symbolic refs.
+/// Loose refs take precedence over packed ones, as in git.
+int read_ref_oid(const ps_repo_paths* paths,
+                 const char* refname,
+                 char* oid_hex,
+                 int depth) {
+  char* path;
+  mapped_file mf;
+  int result;
+  if (depth > 5) {
+    return -1;
+  }
+  // HEAD and other pseudo refs are per-worktree, everything under refs/ is
+  // shared.
+  asprintf(&path, "%s/%s",
+           strncmp(refname, "refs/", 5) == 0 ? paths->commondir : paths->gitdir,
+           refname);
+  int map_result = map_file(path, &mf);
+  free(path);
+  if (map_result != 0) {
+    return read_packed_ref_oid(paths, refname, oid_hex);
+  }
+  if (mf.len > 5 && memcmp(mf.data, "ref: ", 5) == 0) {
+    const char* end = memchr(mf.data, '\n', mf.len);
+    char* target = strndup(
+        mf.data + 5, (end != NULL ? end : mf.data + mf.len) - (mf.data + 5));
+    result = read_ref_oid(paths, target, oid_hex, depth + 1);
+    free(target);
+  } else {
+    result = copy_oid_hex(mf.data, mf.len, oid_hex);
+  }
+  unmap_file(&mf);
+  return result;
+}
+
+/// Returns a copy of the config value starting at `p`, without surrounding
+/// whitespace, quotes and trailing comments.
+char* copy_config_value(const char* p, const char* line_end) {
+  while (p < line_end && isspace((unsigned char)*p)) {
+    p++;
+  }
+  const char* end = p;
+  while (end < line_end && *end != ';' && *end != '#') {
+    end++;
+  }
+  while (end > p && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  if (end - p >= 2 && *p == '"' && end[-1] == '"') {
+    p++;
+    end--;
+  }
+  return strndup(p, end - p);
+}
+
+/// Reads `branch.<name>.remote` and `branch.<name>.merge` from the repository
+/// config and returns the name of the remote-tracking ref they map to. Only
+/// the syntax git itself writes is understood; includes and non-default fetch
+/// refspecs are not followed.
+int read_branch_upstream(const ps_repo_paths* paths,
+                         const char* branch,
+                         char** upstream_ref) {
+  char* path;
+  mapped_file mf;
+  char *remote = NULL, *merge = NULL;
+  int in_section = 0;
+  size_t branch_len = strlen(branch);
+  *upstream_ref = NULL;
+  asprintf(&path, "%s/config", paths->commondir);
+  int map_result = map_file(path, &mf);
+  free(path);
+  if (map_result != 0) {
+    return -1;
+  }
+  const char* line = mf.data;
+  const char* end = mf.data + mf.len;
+  while (line != NULL && line < end) {
+    const char* eol = memchr(line, '\n', end - line);
+    const char* line_end = eol != NULL ? eol : end;
+    const char* p = line;
+    while (p < line_end && isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (p < line_end && *p == '[') {
+      // [branch "name"]
+      in_section = line_end - p > 8 && strncasecmp(p + 1, "branch", 6) == 0;
+      p += 7;
+      while (in_section && p < line_end && isspace((unsigned char)*p)) {
+        p++;
+      }
+      in_section = in_section && line_end - p > (long)branch_len + 1 &&
+                   *p == '"' && memcmp(p + 1, branch, branch_len) == 0 &&
+                   p[branch_len + 1] == '"';
+    } else if (in_section) {
+      const char* key = p;
+      while (p < line_end && (isalnum((unsigned char)*p) || *p == '-')) {
+        p++;
+      }
+      size_t key_len = p - key;
+      while (p < line_end && isspace((unsigned char)*p)) {
+        p++;
+      }
+      if (p < line_end && *p == '=') {
+        if (key_len == 6 && strncasecmp(key, "remote", 6) == 0) {
+          free(remote);
+          remote = copy_config_value(p + 1, line_end);
+        } else if (key_len == 5 && strncasecmp(key, "merge", 5) == 0) {
+          free(merge);
+          merge = copy_config_value(p + 1, line_end);
+        }
+      }
+    }
+    line = eol != NULL ? eol + 1 : NULL;
+  }
+  unmap_file(&mf);
+
+  if (remote != NULL && merge != NULL) {
+    if (strcmp(remote, ".") == 0) {
+      *upstream_ref = strdup(merge);
+    } else if (strncmp(merge, "refs/heads/", 11) == 0) {
+      asprintf(upstream_ref, "refs/remotes/%s/%s", remote, merge + 11);
+    }
+  }
+  free(remote);
+  free(merge);
+  return *upstream_ref != NULL ? 0 : -1;
+}
+
+/// Counts stash entries as lines of the stash reflog. Each `git stash push`
+/// appends one line and `git stash drop` removes one.
+int count_stash_entries(const char* commondir) {
+  char* path;
+  mapped_file mf;
+  int count = 0;
+  asprintf(&path, "%s/logs/refs/stash", commondir);
+  int map_result = map_file(path, &mf);
+  free(path);
+  if (map_result != 0) {
+    return 0;
+  }
+  count = count_lines(mf.data, mf.len);
+  unmap_file(&mf);
+  return count;
+}
 
 /// libgit2 returns null if the branch is new and has no commits. In this case,
 /// HEAD will point to a ref which does not exist as a file inside .git/. Since
 /// I don't know a better API, I am directly reading the file to infer branch
 /// name.
 const char* read_unborn_branch_name(const char* repo_root, int is_bare_repo) {
-  char buf[256];
-  char* path_to_head;
-  asprintf(&path_to_head, "%s/HEAD", repo_root);
-  FILE* fp = fopen(path_to_head, "r");
-  if (fp == NULL) {
-    perror("cannot read name of unborn branch");
-    exit(1);
-  }
-  int n_read = fscanf(fp, "ref: refs/heads/%255s\n", buf);
-  fclose(fp);
-  if (path_to_head != NULL) {
-    free(path_to_head);
-  }
-  if (n_read == 0) {  // should not happen
+  ps_repo_paths paths = {.gitdir = (char*)repo_root,
+                         .commondir = (char*)repo_root};
+  char* head_ref = NULL;
+  if (read_head(&paths, &head_ref, NULL) != 0) {
     fprintf(stderr, "promptsynth: cannot read name of unborn branch\n");
+    exit(1);
   }
   // Technically a memory leak, but that's fine because program exits.
-  return strdup(buf);
+  const char* name = strdup(ref_shorthand(head_ref));
+  free(head_ref);
+  return name;
 }
 
 /// @brief Prints detailed info about last git error, along with given context
@@ -90,15 +476,6 @@ typedef struct callback_context {
   git_index* index;
 } callback_context;
 
-int stash_callback(size_t index,
-                   const char* message,
-                   const git_oid* stash_id,
-                   void* payload) {
-  ps_state* state = (ps_state*)payload;
-  state->stashes++;
-  return 0;
-}
-
 int status_callback(const char* path,
                     unsigned int status_flags,
                     void* payload) {
@@ -126,29 +503,132 @@ int status_callback(const char* path,
   }
 
   if (status_flags & GIT_STATUS_CONFLICTED) {
-    // TODO: Get conflict type
-    // Is it even possible using libgit2?
+    // the operation which caused it is found by detect_operation
     state->conflicted += 1;
   }
   return 0;
 }
 
+/// Reads a progress counter like `rebase-merge/msgnum`. Returns 0 if missing.
+int read_progress_file(const char* gitdir, const char* name) {
+  char* path;
+  asprintf(&path, "%s/%s", gitdir, name);
+  char* line = read_first_line(path, "");
+  int value = line != NULL ? atoi(line) : 0;
+  free(line);
+  free(path);
+  return value;
+}
+
+/// Names a multi-commit cherry-pick or revert by the first verb of
+/// `sequencer/todo`, which is still there after a resolved step is committed
+/// and CHERRY_PICK_HEAD or REVERT_HEAD are gone. Returns NULL otherwise.
+const char* sequencer_operation(const char* gitdir) {
+  char* path;
+  const char* operation = NULL;
+  asprintf(&path, "%s/sequencer/todo", gitdir);
+  char* line = read_first_line(path, "");
+  if (line != NULL) {
+    size_t verb_len = strcspn(line, " \t");
+    if (line[verb_len] != '\0' &&
+        ((verb_len == 1 && line[0] == 'p') ||
+         (verb_len == 4 && strncmp(line, "pick", 4) == 0))) {
+      operation = "CHERRY-PICKING";
+    } else if (line[verb_len] != '\0' && verb_len == 6 &&
+               strncmp(line, "revert", 6) == 0) {
+      operation = "REVERTING";
+    }
+  }
+  free(line);
+  free(path);
+  return operation;
+}
+
+/// detect_operation fills `conflict_type` with the operation in progress, if
+/// any, using the same markers and names as git's own prompt script. It costs
+/// one readdir of the git directory, plus reading the progress files of a
+/// rebase or `git am`, or the todo list of a cherry-pick or revert sequence.
+void detect_operation(const char* gitdir, ps_state* state) {
+  int rebase_merge = 0, rebase_apply = 0, merge = 0, cherry_pick = 0,
+      revert = 0, sequencer = 0, bisect = 0;
+  DIR* dir = opendir(gitdir);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char* name = entry->d_name;
+    rebase_merge |= strcmp(name, "rebase-merge") == 0;
+    rebase_apply |= strcmp(name, "rebase-apply") == 0;
+    merge |= strcmp(name, "MERGE_HEAD") == 0;
+    cherry_pick |= strcmp(name, "CHERRY_PICK_HEAD") == 0;
+    revert |= strcmp(name, "REVERT_HEAD") == 0;
+    sequencer |= strcmp(name, "sequencer") == 0;
+    bisect |= strcmp(name, "BISECT_LOG") == 0;
+  }
+  closedir(dir);
+  const char* sequencer_op = sequencer ? sequencer_operation(gitdir) : NULL;
+
+  if (rebase_merge) {
+    state->conflict_type = "REBASE";
+    state->operation_step = read_progress_file(gitdir, "rebase-merge/msgnum");
+    state->operation_total = read_progress_file(gitdir, "rebase-merge/end");
+  } else if (rebase_apply) {
+    char* path;
+    struct stat st;
+    asprintf(&path, "%s/rebase-apply/rebasing", gitdir);
+    if (stat(path, &st) == 0) {
+      state->conflict_type = "REBASE";
+    } else {
+      free(path);
+      asprintf(&path, "%s/rebase-apply/applying", gitdir);
+      state->conflict_type = stat(path, &st) == 0 ? "AM" : "AM/REBASE";
+    }
+    free(path);
+    state->operation_step = read_progress_file(gitdir, "rebase-apply/next");
+    state->operation_total = read_progress_file(gitdir, "rebase-apply/last");
+  } else if (merge) {
+    state->conflict_type = "MERGING";
+  } else if (cherry_pick) {
+    state->conflict_type = "CHERRY-PICKING";
+  } else if (revert) {
+    state->conflict_type = "REVERTING";
+  } else if (sequencer_op != NULL) {
+    // between the steps of `git cherry-pick A B` or `git revert A B`
+    state->conflict_type = sequencer_op;
+  } else if (bisect) {
+    state->conflict_type = "BISECTING";
+  }
+}
+
 /// compute_repo_state computes the state of the repo, returns PS_ENOTAREPO if
 /// the path is not a git repo
 int compute_repo_state(const char* path, ps_state* state) {
+  return compute_repo_state_with_diffstat(path, state, NULL);
+}
+
+/// Like compute_repo_state, but also counts inserted and deleted lines of the
+/// staged and unstaged changes when `diffstat_limits` is not NULL.
+int compute_repo_state_with_diffstat(
+    const char* path,
+    ps_state* state,
+    const ps_diffstat_limits* diffstat_limits) {
   memset((void*)state, 0, sizeof(ps_state));
   git_status_options opts = GIT_STATUS_OPTIONS_INIT;
   // TODO: Do we need GIT_STATUS_OPT_RENAMES_INDEX_TO_WORKDIR?
   // I believe `git` doesnt detect such renames, it will rather show up as a
   // delete and an add.
+  // GIT_STATUS_OPT_RENAMES_FROM_REWRITES is not used: `git status` does not
+  // break rewritten files, so pairing one with a deleted file as a rename
+  // differs from git (found by promptsynth_difftest).
   opts.flags |= GIT_STATUS_OPT_INCLUDE_UNTRACKED |
                 GIT_STATUS_OPT_EXCLUDE_SUBMODULES |
-                GIT_STATUS_OPT_RENAMES_FROM_REWRITES |
                 GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
   git_repository* repo = NULL;
   git_buf repo_root = {0};
   git_reference* head = NULL;
   git_index* index = NULL;
+  git_status_list* status = NULL;
   callback_context context;
   char hash_buf[8] = {0};
 
@@ -188,15 +668,28 @@ int compute_repo_state(const char* path, ps_state* state) {
   // get ahead-behind info
   get_ahead_behind(repo, head, state);
 
-  // get number of stash entries
-  git_stash_foreach(repo, stash_callback, (void*)state);
+  // get number of stash entries, without loading the stash commits
+  state->stashes = count_stash_entries(git_repository_commondir(repo));
+
+  // rebase, merge etc. in progress
+  detect_operation(git_repository_path(repo), state);
 
   // count the numbers
   context.state = state;
   context.index = index;
-  handle_git_error(
-      git_status_foreach_ext(repo, &opts, status_callback, &context),
-      "status_foreach");
+  handle_git_error(git_status_list_new(&status, repo, &opts), "status_list");
+  for (size_t i = 0; i < git_status_list_entrycount(status); i++) {
+    const git_status_entry* entry = git_status_byindex(status, i);
+    // the same path git_status_foreach_ext would report
+    const git_diff_delta* delta = entry->head_to_index != NULL
+                                      ? entry->head_to_index
+                                      : entry->index_to_workdir;
+    status_callback(delta->old_file.path, entry->status, &context);
+  }
+  if (diffstat_limits != NULL) {
+    compute_diffstat(repo, status, diffstat_limits, state);
+  }
+  git_status_list_free(status);
   git_index_free(index);
   git_reference_free(head);
   git_repository_free(repo);
@@ -205,12 +698,70 @@ int compute_repo_state(const char* path, ps_state* state) {
   return 0;
 }
 
+/// Fills `has_upstream` from config and refs. Ahead/behind counts are only
+/// known when both sides point at the same commit.
+void read_refs_upstream(const ps_repo_paths* paths,
+                        const char* head_ref,
+                        ps_state* state) {
+  char local_oid[MAX_OID_HEX_LEN + 1], upstream_oid[MAX_OID_HEX_LEN + 1];
+  char* upstream_ref = NULL;
+  if (strncmp(head_ref, "refs/heads/", 11) != 0 ||
+      read_ref_oid(paths, head_ref, local_oid, 0) != 0) {
+    return;  // not a branch, or an unborn one
+  }
+  if (read_branch_upstream(paths, ref_shorthand(head_ref), &upstream_ref) !=
+      0) {
+    return;
+  }
+  if (read_ref_oid(paths, upstream_ref, upstream_oid, 0) == 0) {
+    state->has_upstream = 1;
+    state->ahead_behind_unknown = strcmp(local_oid, upstream_oid) != 0;
+  }
+  free(upstream_ref);
+}
+
+/// compute_refs_state fills only the parts of the state which can be read
+/// from HEAD, refs, config and the stash reflog: branch name, detached hash,
+/// upstream, stash count and the operation in progress. It does not open the
+/// repository with libgit2, so it can be used when worktree status is not
+/// wanted. Returns PS_ENOTAREPO if the path is not a git repo.
+int compute_refs_state(const char* path, ps_state* state) {
+  ps_repo_paths paths;
+  char* head_ref = NULL;
+  char head_oid[MAX_OID_HEX_LEN + 1] = {0};
+  memset((void*)state, 0, sizeof(ps_state));
+  if (discover_repo_paths(path, &paths) != 0) {
+    return PS_ENOTAREPO;
+  }
+
+  if (read_head(&paths, &head_ref, head_oid) != 0) {
+    fprintf(stderr, "promptsynth: cannot read HEAD\n");
+    state->branch_name = NULL;
+  } else if (head_ref == NULL) {
+    state->is_hash = 1;
+    asprintf((char**)&state->branch_name, ":%.7s", head_oid);
+  } else {
+    state->branch_name =
+        strndup(ref_shorthand(head_ref), MAX_CHARS_IN_REF_SHORTHAND);
+    read_refs_upstream(&paths, head_ref, state);
+  }
+
+  state->stashes = count_stash_entries(paths.commondir);
+  detect_operation(paths.gitdir, state);
+  free(head_ref);
+  free_repo_paths(&paths);
+  return 0;
+}
+
 void debug_print_repo_state(ps_state* state) {
   printf("unstaged={+%d ~%d -%d}\n", state->unstaged.added,
          state->unstaged.modified, state->unstaged.deleted);
   printf("staged={+%d ~%d -%d}\n", state->staged.added, state->staged.modified,
          state->staged.deleted);
   printf("conflicted=%d\n", state->conflicted);
+  printf("conflict_type=%s %d/%d\n",
+         state->conflict_type != NULL ? state->conflict_type : "(none)",
+         state->operation_step, state->operation_total);
   printf("branchname=%s\n", state->branch_name);
   printf("is_hash=%d\n", state->is_hash);
 }
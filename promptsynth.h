@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #define ANSI_RED "31"
 #define ANSI_RED_BOLD "31;1"
 #define ANSI_GREEN "32"
@@ -16,8 +18,10 @@
 #define ANSI_WHITE_BOLD "37;1"
 
 #define MAX_CHARS_IN_REF_SHORTHAND 32
+#define MAX_OID_HEX_LEN 64
 
 #define PS_ENOTAREPO -16
+#define PS_EBUSY -17
 
 typedef struct file_triplet {
   int modified;
@@ -25,16 +29,82 @@ typedef struct file_triplet {
   int deleted;
 } file_triplet;
 
+/// Inserted and deleted lines of one side of the changes. `over_cap` is set
+/// when a byte cap was hit and the counts are incomplete.
+typedef struct line_delta {
+  int insertions;
+  int deletions;
+  int over_cap;
+} line_delta;
+
+/// Byte caps for line counting. Files larger than `file_cap` and everything
+/// past `total_cap` bytes per prompt are not diffed.
+typedef struct ps_diffstat_limits {
+  size_t file_cap;
+  size_t total_cap;
+} ps_diffstat_limits;
+
 typedef struct ps_state {
   struct file_triplet staged, unstaged;
   int ahead_by, behind_by, has_upstream;
+  // set when an upstream exists but ahead/behind counts were not computed
+  int ahead_behind_unknown;
   const char* branch_name;
   int is_hash;
+  // operation in progress, like "REBASE" or "MERGING", with its progress
+  // when known
   const char* conflict_type;
+  int operation_step, operation_total;
   int conflicted;
   int stashes;
+  int has_diffstat;
+  struct line_delta staged_lines, unstaged_lines;
 } ps_state;
 
+typedef struct mapped_file {
+  const char* data;
+  size_t len;
+} mapped_file;
+
+int map_file(const char* path, mapped_file* mf);
+
+void unmap_file(mapped_file* mf);
+
+/// Paths of a repository found by walking up from a directory, without
+/// opening it through libgit2. `commondir` differs from `gitdir` only for
+/// linked worktrees. `workdir` is NULL for bare repositories.
+typedef struct ps_repo_paths {
+  char* gitdir;
+  char* commondir;
+  char* workdir;
+} ps_repo_paths;
+
+int discover_repo_paths(const char* path, ps_repo_paths* paths);
+
+void free_repo_paths(ps_repo_paths* paths);
+
 int compute_repo_state(const char* path, ps_state* state);
 
+int compute_repo_state_with_diffstat(const char* path,
+                                     ps_state* state,
+                                     const ps_diffstat_limits* diffstat_limits);
+
+int compute_refs_state(const char* path, ps_state* state);
+
+int prefetch_repo(const char* path);
+
+void detect_operation(const char* gitdir, ps_state* state);
+
+size_t count_newlines(const char* data, size_t len);
+
+size_t count_lines(const char* data, size_t len);
+
+struct git_repository;
+struct git_status_list;
+
+void compute_diffstat(struct git_repository* repo,
+                      struct git_status_list* status,
+                      const ps_diffstat_limits* limits,
+                      ps_state* state);
+
 void debug_print_repo_state(ps_state* state);
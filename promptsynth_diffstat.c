@@ -0,0 +1,506 @@
+#include <git2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "promptsynth.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DIFFSTAT_CACHE_FILE "promptsynth-diffstat"
+// git looks for NUL bytes in the same number of leading bytes
+#define BINARY_PROBE_LEN 8000
+
+/// Counts '\n' bytes, 64 bytes per iteration where SSE2 is available.
+size_t count_newlines(const char* data, size_t len) {
+  size_t count = 0, i = 0;
+#if defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 64 <= len; i += 64) {
+    const __m128i* p = (const __m128i*)(data + i);
+    unsigned long long mask =
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p), newline)) |
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), newline))
+            << 16 |
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 2), newline))
+            << 32 |
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), newline))
+            << 48;
+    count += __builtin_popcountll(mask);
+  }
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+    count += __builtin_popcount(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+  }
+#endif
+  for (; i < len; i++) {
+    count += data[i] == '\n';
+  }
+  return count;
+}
+
+/// Number of lines, counting an unterminated last line.
+size_t count_lines(const char* data, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  return count_newlines(data, len) + (data[len - 1] != '\n');
+}
+
+typedef struct diffstat_cache_entry {
+  git_oid old_id, new_id;
+  int insertions, deletions;
+  int used;
+} diffstat_cache_entry;
+
+/// Line counts of previous prompts, keyed by the blob ids of both sides, or
+/// by the stat data of a worktree file for its new side.
+/// It is kept in the git directory, and only entries used by the last prompt
+/// are written back so it does not grow over time. `slots` is an open
+/// addressing hash table of entry index + 1, with 0 for empty slots.
+typedef struct diffstat_cache {
+  diffstat_cache_entry* entries;
+  size_t count, capacity;
+  size_t* slots;
+  size_t slot_count;
+  int dirty;
+} diffstat_cache;
+
+size_t oid_pair_hash(const git_oid* old_id, const git_oid* new_id) {
+  uint64_t a, b;
+  // object ids are already uniformly distributed
+  memcpy(&a, old_id->id, sizeof(a));
+  memcpy(&b, new_id->id, sizeof(b));
+  return (size_t)(a ^ (b * 0x9E3779B97F4A7C15ull));
+}
+
+/// Returns the slot holding the pair, or the empty slot where it would go.
+size_t* cache_slot(diffstat_cache* cache,
+                   const git_oid* old_id,
+                   const git_oid* new_id) {
+  size_t mask = cache->slot_count - 1;
+  size_t i = oid_pair_hash(old_id, new_id) & mask;
+  for (;; i = (i + 1) & mask) {
+    size_t* slot = &cache->slots[i];
+    if (*slot == 0) {
+      return slot;
+    }
+    diffstat_cache_entry* entry = &cache->entries[*slot - 1];
+    if (git_oid_cmp(&entry->old_id, old_id) == 0 &&
+        git_oid_cmp(&entry->new_id, new_id) == 0) {
+      return slot;
+    }
+  }
+}
+
+/// Keeps the table at most half full.
+void cache_grow_slots(diffstat_cache* cache) {
+  if ((cache->count + 1) * 2 <= cache->slot_count) {
+    return;
+  }
+  free(cache->slots);
+  cache->slot_count = cache->slot_count == 0 ? 128 : cache->slot_count * 2;
+  cache->slots = calloc(cache->slot_count, sizeof(size_t));
+  for (size_t i = 0; i < cache->count; i++) {
+    diffstat_cache_entry* entry = &cache->entries[i];
+    *cache_slot(cache, &entry->old_id, &entry->new_id) = i + 1;
+  }
+}
+
+diffstat_cache_entry* cache_find(diffstat_cache* cache,
+                                 const git_oid* old_id,
+                                 const git_oid* new_id) {
+  if (cache->slot_count == 0) {
+    return NULL;
+  }
+  size_t slot = *cache_slot(cache, old_id, new_id);
+  return slot != 0 ? &cache->entries[slot - 1] : NULL;
+}
+
+/// Adds an entry for a pair which is not in the cache yet.
+diffstat_cache_entry* cache_add(diffstat_cache* cache,
+                                const git_oid* old_id,
+                                const git_oid* new_id) {
+  if (cache->count == cache->capacity) {
+    cache->capacity = cache->capacity == 0 ? 64 : cache->capacity * 2;
+    cache->entries =
+        realloc(cache->entries, cache->capacity * sizeof(diffstat_cache_entry));
+  }
+  cache_grow_slots(cache);
+  diffstat_cache_entry* entry = &cache->entries[cache->count];
+  memset((void*)entry, 0, sizeof(diffstat_cache_entry));
+  entry->old_id = *old_id;
+  entry->new_id = *new_id;
+  *cache_slot(cache, old_id, new_id) = ++cache->count;
+  return entry;
+}
+
+/// Cache lines are `<old id> <new id> <insertions> <deletions>`.
+void cache_load(diffstat_cache* cache, const char* path) {
+  mapped_file mf;
+  if (map_file(path, &mf) != 0) {
+    return;
+  }
+  const char* line = mf.data;
+  const char* end = mf.data + mf.len;
+  while (line != NULL && line < end) {
+    const char* eol = memchr(line, '\n', end - line);
+    char buf[256];
+    size_t line_len = (eol != NULL ? eol : end) - line;
+    char old_hex[GIT_OID_HEXSZ + 1], new_hex[GIT_OID_HEXSZ + 1];
+    int insertions, deletions;
+    git_oid old_id, new_id;
+    if (line_len < sizeof(buf)) {
+      memcpy(buf, line, line_len);
+      buf[line_len] = '\0';
+      if (sscanf(buf, "%40s %40s %d %d", old_hex, new_hex, &insertions,
+                 &deletions) == 4 &&
+          insertions >= 0 && deletions >= 0 &&
+          git_oid_fromstr(&old_id, old_hex) == 0 &&
+          git_oid_fromstr(&new_id, new_hex) == 0 &&
+          cache_find(cache, &old_id, &new_id) == NULL) {
+        diffstat_cache_entry* entry = cache_add(cache, &old_id, &new_id);
+        entry->insertions = insertions;
+        entry->deletions = deletions;
+      }
+    }
+    line = eol != NULL ? eol + 1 : NULL;
+  }
+  unmap_file(&mf);
+}
+
+void cache_save(diffstat_cache* cache, const char* path) {
+  char old_hex[GIT_OID_HEXSZ + 1], new_hex[GIT_OID_HEXSZ + 1];
+  char* tmp_path;
+  int stale = 0;
+  for (size_t i = 0; i < cache->count; i++) {
+    stale += !cache->entries[i].used;
+  }
+  if (!cache->dirty && stale == 0) {
+    return;
+  }
+  // write and rename, so that concurrent prompts never see a partial file
+  asprintf(&tmp_path, "%s.%d", path, (int)getpid());
+  FILE* fp = fopen(tmp_path, "w");
+  if (fp != NULL) {
+    for (size_t i = 0; i < cache->count; i++) {
+      diffstat_cache_entry* entry = &cache->entries[i];
+      if (!entry->used) {
+        continue;
+      }
+      git_oid_tostr(old_hex, sizeof(old_hex), &entry->old_id);
+      git_oid_tostr(new_hex, sizeof(new_hex), &entry->new_id);
+      fprintf(fp, "%s %s %d %d\n", old_hex, new_hex, entry->insertions,
+              entry->deletions);
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+      unlink(tmp_path);
+    }
+  }
+  free(tmp_path);
+}
+
+int is_binary(const char* data, size_t len) {
+  return data != NULL &&
+         memchr(data, '\0', len < BINARY_PROBE_LEN ? len : BINARY_PROBE_LEN) !=
+             NULL;
+}
+
+/// Counts changed lines between two versions of a file. When one version is
+/// a prefix of the other, which is the common case of appending to a file,
+/// only the lines after the last shared newline are counted and no diff is
+/// run at all.
+void diff_buffers(const char* old_data,
+                  size_t old_len,
+                  const char* new_data,
+                  size_t new_len,
+                  int* insertions,
+                  int* deletions) {
+  size_t common = old_len < new_len ? old_len : new_len;
+  *insertions = 0;
+  *deletions = 0;
+  if (is_binary(old_data, old_len) || is_binary(new_data, new_len)) {
+    return;  // git shows binary files without line counts
+  }
+  if (common == 0 || memcmp(old_data, new_data, common) == 0) {
+    if (old_len == new_len) {
+      return;
+    }
+    // the last shared line is changed if it was unterminated on one side
+    size_t start = common;
+    while (start > 0 && old_data[start - 1] != '\n') {
+      start--;
+    }
+    *insertions = count_lines(new_data + start, new_len - start);
+    *deletions = count_lines(old_data + start, old_len - start);
+    return;
+  }
+  git_patch* patch = NULL;
+  size_t context = 0, added = 0, deleted = 0;
+  if (git_patch_from_buffers(&patch, old_data, old_len, NULL, new_data,
+                             new_len, NULL, NULL) == 0) {
+    git_patch_line_stats(&context, &added, &deleted, patch);
+    *insertions = added;
+    *deletions = deleted;
+  }
+  git_patch_free(patch);
+}
+
+/// One version of a file: a blob, or a file in the worktree.
+typedef struct diff_side {
+  git_blob* blob;
+  mapped_file mapped;
+  git_buf filtered;
+  char* link_target;
+  const char* data;
+  size_t len;
+} diff_side;
+
+void release_side(diff_side* side) {
+  git_blob_free(side->blob);
+  unmap_file(&side->mapped);
+  git_buf_dispose(&side->filtered);
+  free(side->link_target);
+  memset((void*)side, 0, sizeof(diff_side));
+}
+
+/// Reads the size of a blob from its object header, so that blobs over the
+/// cap are never inflated. A zero id is the missing side of an added or
+/// deleted file and has size 0.
+int blob_size(git_odb* odb, const git_oid* id, size_t* size) {
+  git_object_t type;
+  *size = 0;
+  if (git_oid_is_zero(id)) {
+    return 0;
+  }
+  return git_odb_read_header(size, &type, odb, id);
+}
+
+int load_blob_side(git_repository* repo, const git_oid* id, diff_side* side) {
+  memset((void*)side, 0, sizeof(diff_side));
+  if (git_oid_is_zero(id)) {
+    return 0;
+  }
+  if (git_blob_lookup(&side->blob, repo, id) != 0) {
+    return -1;
+  }
+  side->len = git_blob_rawsize(side->blob);
+  side->data = git_blob_rawcontent(side->blob);
+  return 0;
+}
+
+/// Builds the cache key of a worktree file from its stat data, like the index
+/// does, so that a cache hit needs neither reading nor hashing the file.
+/// `cacheable` is cleared when the file was modified in the current second,
+/// since a later write in the same second could keep the same stat data.
+int workdir_key(const char* workdir,
+                const git_diff_file* file,
+                git_oid* key,
+                size_t* size,
+                int* cacheable) {
+  struct stat st;
+  char* path;
+  char* stat_data;
+  asprintf(&path, "%s%s", workdir, file->path);
+  int result = lstat(path, &st);
+  free(path);
+  if (result != 0) {
+    return -1;
+  }
+  int len = asprintf(&stat_data, "%s %lld %lld.%09ld %lld.%09ld %llu %llu %o",
+                     file->path, (long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                     (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+                     (unsigned long long)st.st_dev,
+                     (unsigned long long)st.st_ino, (unsigned)st.st_mode);
+  git_odb_hash(key, stat_data, len, GIT_OBJECT_BLOB);
+  free(stat_data);
+  *size = st.st_size;
+  *cacheable = st.st_mtim.tv_sec < time(NULL);
+  return 0;
+}
+
+/// Loads a worktree file the way `git add` would store it, i.e. with clean
+/// and end-of-line filters applied.
+int load_workdir_side(git_repository* repo,
+                      const char* workdir,
+                      const git_diff_file* file,
+                      diff_side* side) {
+  struct stat st;
+  char* path;
+  int result = 0;
+  git_filter_list* filters = NULL;
+  memset((void*)side, 0, sizeof(diff_side));
+  asprintf(&path, "%s%s", workdir, file->path);
+  if (lstat(path, &st) != 0) {
+    result = -1;
+  } else if (S_ISLNK(st.st_mode)) {
+    // git stores the target of a symlink as its content
+    side->link_target = calloc(st.st_size + 1, 1);
+    ssize_t n = readlink(path, side->link_target, st.st_size + 1);
+    if (n < 0) {
+      result = -1;
+    } else {
+      side->data = side->link_target;
+      side->len = n;
+    }
+  } else if (git_filter_list_load(&filters, repo, NULL, file->path,
+                                  GIT_FILTER_TO_ODB, GIT_FILTER_DEFAULT) != 0) {
+    result = -1;
+  } else if (filters != NULL) {
+    // e.g. core.autocrlf or .gitattributes eol/filter apply to this path
+    if (git_filter_list_apply_to_file(&side->filtered, filters, repo,
+                                      file->path) != 0) {
+      result = -1;
+    } else {
+      side->data = side->filtered.ptr;
+      side->len = side->filtered.size;
+    }
+  } else if (map_file(path, &side->mapped) != 0) {
+    result = -1;
+  } else {
+    side->data = side->mapped.data;
+    side->len = side->mapped.len;
+  }
+  git_filter_list_free(filters);
+  free(path);
+  return result;
+}
+
+typedef struct diffstat_run {
+  git_repository* repo;
+  git_odb* odb;
+  const char* workdir;
+  const ps_diffstat_limits* limits;
+  diffstat_cache cache;
+  size_t bytes_diffed;
+} diffstat_run;
+
+/// Adds the line counts of one delta to `total`. The new side is read from
+/// the worktree when `from_workdir` is set. Sizes come from object headers
+/// or lstat, and the cache is consulted before any file is read, so only
+/// cache misses within the caps cost I/O.
+void diffstat_delta(diffstat_run* run,
+                    const git_diff_delta* delta,
+                    int from_workdir,
+                    line_delta* total) {
+  diff_side old_side, new_side;
+  git_oid new_key = {0};
+  size_t old_size, new_size = 0;
+  int cacheable = 1, insertions, deletions;
+  if (delta->old_file.mode == GIT_FILEMODE_COMMIT ||
+      delta->new_file.mode == GIT_FILEMODE_COMMIT) {
+    return;  // submodules have no lines
+  }
+
+  if (blob_size(run->odb, &delta->old_file.id, &old_size) != 0) {
+    return;
+  }
+  if (delta->status == GIT_DELTA_DELETED) {
+    // the zero id is the real key of a deleted file
+  } else if (!from_workdir) {
+    new_key = delta->new_file.id;
+    if (blob_size(run->odb, &new_key, &new_size) != 0) {
+      return;
+    }
+  } else if (workdir_key(run->workdir, &delta->new_file, &new_key, &new_size,
+                         &cacheable) != 0) {
+    return;
+  }
+  // over-cap results are not cached, so that raising the cap takes effect
+  if (old_size > run->limits->file_cap || new_size > run->limits->file_cap) {
+    total->over_cap = 1;
+    return;
+  }
+
+  diffstat_cache_entry* entry =
+      cacheable ? cache_find(&run->cache, &delta->old_file.id, &new_key)
+                : NULL;
+  if (entry != NULL) {
+    entry->used = 1;
+    total->insertions += entry->insertions;
+    total->deletions += entry->deletions;
+    return;
+  }
+  if (run->bytes_diffed + old_size + new_size > run->limits->total_cap) {
+    total->over_cap = 1;  // not cached, the total cap depends on the prompt
+    return;
+  }
+  run->bytes_diffed += old_size + new_size;
+
+  int new_result = 0;
+  int old_result = load_blob_side(run->repo, &delta->old_file.id, &old_side);
+  if (from_workdir && delta->status != GIT_DELTA_DELETED) {
+    new_result = load_workdir_side(run->repo, run->workdir, &delta->new_file,
+                                   &new_side);
+  } else {
+    new_result = load_blob_side(run->repo, &new_key, &new_side);
+  }
+  if (old_result == 0 && new_result == 0) {
+    diff_buffers(old_side.data, old_side.len, new_side.data, new_side.len,
+                 &insertions, &deletions);
+    total->insertions += insertions;
+    total->deletions += deletions;
+    if (cacheable) {
+      entry = cache_add(&run->cache, &delta->old_file.id, &new_key);
+      entry->insertions = insertions;
+      entry->deletions = deletions;
+      entry->used = 1;
+      run->cache.dirty = 1;
+    }
+  }
+  release_side(&old_side);
+  release_side(&new_side);
+}
+
+/// compute_diffstat counts inserted and deleted lines of the staged
+/// (HEAD to index) and unstaged (index to worktree) changes in `status`, like
+/// `git diff --stat`. Untracked files are not counted.
+void compute_diffstat(git_repository* repo,
+                      git_status_list* status,
+                      const ps_diffstat_limits* limits,
+                      ps_state* state) {
+  diffstat_run run = {0};
+  char* cache_path;
+  run.repo = repo;
+  run.workdir = git_repository_workdir(repo);
+  run.limits = limits;
+  if (git_repository_odb(&run.odb, repo) != 0) {
+    return;
+  }
+  asprintf(&cache_path, "%s" DIFFSTAT_CACHE_FILE, git_repository_path(repo));
+  cache_load(&run.cache, cache_path);
+
+  for (size_t i = 0; i < git_status_list_entrycount(status); i++) {
+    const git_status_entry* entry = git_status_byindex(status, i);
+    if (entry->status & GIT_STATUS_CONFLICTED) {
+      continue;
+    }
+    if (entry->head_to_index != NULL) {
+      diffstat_delta(&run, entry->head_to_index, 0, &state->staged_lines);
+    }
+    if (entry->index_to_workdir != NULL && run.workdir != NULL &&
+        (entry->status & (GIT_STATUS_WT_MODIFIED | GIT_STATUS_WT_DELETED |
+                          GIT_STATUS_WT_TYPECHANGE))) {
+      diffstat_delta(&run, entry->index_to_workdir, 1, &state->unstaged_lines);
+    }
+  }
+  state->has_diffstat = 1;
+
+  cache_save(&run.cache, cache_path);
+  free(run.cache.entries);
+  free(run.cache.slots);
+  free(cache_path);
+  git_odb_free(run.odb);
+}
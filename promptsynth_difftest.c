@@ -0,0 +1,604 @@
+#include "promptsynth.h"
+
+#include <git2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Differential test: applies random mutations to generated repositories and
+// after every step compares the computed state against
+// `git status --porcelain=v2 --branch --show-stash`. It also times
+// compute_repo_state against `git status` on a larger generated repository
+// and fails if the ratio regresses past a stored baseline.
+//
+// usage: promptsynth_difftest [--seed N] [--rounds N] [--steps N]
+//                             [--baseline FILE] [--tolerance X] [--record]
+
+#define LEN(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define TEMP_DIR_NAME "temp_dir_difftest"
+#define FILE_POOL_SIZE 24
+#define CMD_BUF_SIZE 1024
+// the latency repo has enough files for the status walk to dominate fixed
+// costs like opening the repository
+#define LATENCY_REPO_DIRS 100
+#define LATENCY_REPO_FILES 100
+#define LATENCY_RUNS 15
+// single threaded like libgit2, and without refreshing the index, so that
+// every run does the same work
+#define GIT_STATUS_REFERENCE                                   \
+  "git --no-optional-locks -c core.preloadIndex=false status " \
+  "--porcelain=v2 --branch --show-stash"
+
+#define PR_RED "\e[31m"
+#define PR_GREEN "\e[32m"
+#define PR_YELLOW "\e[33m"
+#define PR_BLUE "\e[34m"
+#define PR_RESET "\e[0m"
+
+typedef struct difftest_options {
+  unsigned long seed;
+  int rounds, steps, record;
+  double tolerance;
+  const char* baseline_file;
+} difftest_options;
+
+// xorshift, so that a seed replays the same steps with any libc
+unsigned long next_random(unsigned long* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+int random_below(unsigned long* state, int n) {
+  return (int)(next_random(state) % n);
+}
+
+int run_command(const char* command) {
+  char quiet[CMD_BUF_SIZE + 32];
+  snprintf(quiet, sizeof(quiet), "(%s) >/dev/null 2>&1", command);
+  return system(quiet);
+}
+
+const char* pool_file(unsigned long* rng, char* buf, size_t len) {
+  int n = random_below(rng, FILE_POOL_SIZE);
+  // a third of the files live in subdirectories
+  if (n % 3 == 0) {
+    snprintf(buf, len, "dir%d/file%d.txt", n % 4, n);
+  } else {
+    snprintf(buf, len, "file%d.txt", n);
+  }
+  return buf;
+}
+
+/// Builds the shell command of one random mutation into `cmd`. Commands may
+/// fail, e.g. committing with nothing staged; that is part of the test.
+const char* random_mutation(unsigned long* rng, int step, char* cmd) {
+  char file[64], other[64];
+  pool_file(rng, file, sizeof(file));
+  pool_file(rng, other, sizeof(other));
+  unsigned long word = next_random(rng) % 100000;
+  switch (random_below(rng, 18)) {
+    case 0:
+    case 1:
+    case 2:
+      snprintf(cmd, CMD_BUF_SIZE, "mkdir -p $(dirname %s) && echo %lu >> %s",
+               file, word, file);
+      return "append";
+    case 3:
+      snprintf(cmd, CMD_BUF_SIZE,
+               "test -f %s && sed -i '1s/.*/%lu/' %s", file, word, file);
+      return "edit";
+    case 4:
+      snprintf(cmd, CMD_BUF_SIZE, "rm -f %s", file);
+      return "delete";
+    case 5:
+      snprintf(cmd, CMD_BUF_SIZE, "mkdir -p $(dirname %s) && git mv %s %s",
+               other, file, other);
+      return "git mv";
+    case 6:
+      snprintf(cmd, CMD_BUF_SIZE, "mkdir -p $(dirname %s) && mv %s %s", other,
+               file, other);
+      return "mv";
+    case 7:
+    case 8:
+      snprintf(cmd, CMD_BUF_SIZE, "git add -A -- %s", file);
+      return "stage file";
+    case 9:
+      snprintf(cmd, CMD_BUF_SIZE, "git add -A");
+      return "stage all";
+    case 10:
+      snprintf(cmd, CMD_BUF_SIZE, "git reset -q -- %s", file);
+      return "unstage";
+    case 11:
+      snprintf(cmd, CMD_BUF_SIZE, "git commit -q -m step%d", step);
+      return "commit";
+    case 12:
+      snprintf(cmd, CMD_BUF_SIZE, "git stash push -q -u");
+      return "stash";
+    case 13:
+      snprintf(cmd, CMD_BUF_SIZE, "git stash pop -q");
+      return "stash pop";
+    case 14:
+      // move the upstream without touching the worktree
+      snprintf(cmd, CMD_BUF_SIZE,
+               "git update-ref refs/heads/base "
+               "$(git commit-tree 'base^{tree}' -p base -m up%d)",
+               step);
+      return "diverge upstream";
+    case 15:
+      snprintf(cmd, CMD_BUF_SIZE, "git update-ref refs/heads/base HEAD");
+      return "sync upstream";
+    case 16:
+      snprintf(cmd, CMD_BUF_SIZE,
+               "git stash push -q -u; git checkout -q main && "
+               "git checkout -q -b side%d && echo side%d > conflict.txt && "
+               "git add conflict.txt && git commit -q -m side%d && "
+               "git checkout -q main && echo main%d > conflict.txt && "
+               "git add conflict.txt && git commit -q -m main%d && "
+               "git merge -q side%d",
+               step, step, step, step, step, step);
+      return "conflict";
+    default:
+      if (random_below(rng, 2) == 0) {
+        snprintf(cmd, CMD_BUF_SIZE, "git add -A && git commit -q --no-edit");
+        return "resolve";
+      }
+      snprintf(cmd, CMD_BUF_SIZE, "git merge --abort");
+      return "abort merge";
+  }
+}
+
+/// Generates a repository of random size tracking `base` as upstream.
+int setup_repo(unsigned long* rng) {
+  char cmd[CMD_BUF_SIZE];
+  const char* commands[] = {
+      "git init -q",
+      "git checkout -q -b main",
+  };
+  for (int i = 0; i < LEN(commands); i++) {
+    if (run_command(commands[i]) != 0) {
+      return -1;
+    }
+  }
+  int files = 4 + random_below(rng, FILE_POOL_SIZE - 4);
+  for (int i = 0; i < files; i++) {
+    char file[64];
+    pool_file(rng, file, sizeof(file));
+    snprintf(cmd, sizeof(cmd), "mkdir -p $(dirname %s) && seq %d %d > %s",
+             file, i, i + random_below(rng, 50), file);
+    run_command(cmd);
+  }
+  const char* finish[] = {
+      "git add -A && git commit -q -m Initial",
+      "git branch base",
+      "git branch --set-upstream-to=base",
+  };
+  for (int i = 0; i < LEN(finish); i++) {
+    if (run_command(finish[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/// Reads what git itself reports into the same shape as ps_state.
+/// `branch_oid` receives the full object id of HEAD.
+int read_git_status(ps_state* expected, char* branch_oid, size_t oid_len) {
+  char line[4096];
+  static char branch[256];
+  memset((void*)expected, 0, sizeof(ps_state));
+  branch_oid[0] = '\0';
+  FILE* fp = popen("git status --porcelain=v2 --branch --show-stash", "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char x, y;
+    int ahead, behind;
+    if (sscanf(line, "# branch.head %255s", branch) == 1) {
+      expected->is_hash = strcmp(branch, "(detached)") == 0;
+      expected->branch_name = branch;
+    } else if (strncmp(line, "# branch.oid ", 13) == 0) {
+      snprintf(branch_oid, oid_len, "%.*s", (int)strcspn(line + 13, "\n"),
+               line + 13);
+    } else if (sscanf(line, "# branch.ab +%d -%d", &ahead, &behind) == 2) {
+      expected->has_upstream = 1;
+      expected->ahead_by = ahead;
+      expected->behind_by = behind;
+    } else if (sscanf(line, "# stash %d", &expected->stashes) == 1) {
+      continue;
+    } else if (line[0] == '?') {
+      expected->unstaged.added++;
+    } else if (line[0] == 'u') {
+      expected->conflicted++;
+    } else if ((line[0] == '1' || line[0] == '2') &&
+               sscanf(line + 2, "%c%c", &x, &y) == 2) {
+      // mirrors the buckets of status_callback
+      if (x == 'A') {
+        expected->staged.added++;
+      } else if (x == 'M' || x == 'T' || x == 'R') {
+        expected->staged.modified++;
+      } else if (x == 'D') {
+        expected->staged.deleted++;
+      }
+      if (y == 'M' || y == 'T') {
+        expected->unstaged.modified++;
+      } else if (y == 'D') {
+        expected->unstaged.deleted++;
+      }
+    }
+  }
+  if (pclose(fp) != 0) {
+    return -1;
+  }
+  // the only operation the mutations leave in progress is a conflicted merge
+  if (run_command("git rev-parse -q --verify MERGE_HEAD") == 0) {
+    expected->conflict_type = "MERGING";
+  }
+  return 0;
+}
+
+/// Sums `git diff --numstat` output, skipping binary files.
+line_delta read_git_numstat(const char* command) {
+  char line[4096];
+  line_delta total = {0};
+  FILE* fp = popen(command, "r");
+  if (fp == NULL) {
+    return total;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    int insertions, deletions;
+    if (sscanf(line, "%d %d", &insertions, &deletions) == 2) {
+      total.insertions += insertions;
+      total.deletions += deletions;
+    }
+  }
+  pclose(fp);
+  return total;
+}
+
+int check_field(const char* name, long expected, long actual) {
+  if (expected == actual) {
+    return 0;
+  }
+  fprintf(stderr, PR_RED "  %s: git says %ld, promptsynth says %ld" PR_RESET
+                         "\n",
+          name, expected, actual);
+  return -1;
+}
+
+int check_operation(const char* name,
+                    const ps_state* expected,
+                    const ps_state* actual) {
+  const char* expected_type =
+      expected->conflict_type != NULL ? expected->conflict_type : "(none)";
+  const char* actual_type =
+      actual->conflict_type != NULL ? actual->conflict_type : "(none)";
+  if (strcmp(expected_type, actual_type) == 0 &&
+      actual->operation_step == 0 && actual->operation_total == 0) {
+    return 0;
+  }
+  fprintf(stderr,
+          PR_RED "  %s: git says %s, promptsynth says %s %d/%d" PR_RESET "\n",
+          name, expected_type, actual_type, actual->operation_step,
+          actual->operation_total);
+  return -1;
+}
+
+int check_branch(const ps_state* expected,
+                 const char* branch_oid,
+                 const ps_state* actual) {
+  if (actual->branch_name == NULL ||
+      expected->is_hash != actual->is_hash) {
+    fprintf(stderr, PR_RED "  branch: git says %s, promptsynth says %s" PR_RESET
+                           "\n",
+            expected->branch_name, actual->branch_name);
+    return -1;
+  }
+  int same = expected->is_hash
+                 ? strncmp(actual->branch_name + 1, branch_oid, 7) == 0
+                 : strcmp(actual->branch_name, expected->branch_name) == 0;
+  if (!same) {
+    fprintf(stderr, PR_RED "  branch: git says %s, promptsynth says %s" PR_RESET
+                           "\n",
+            expected->is_hash ? branch_oid : expected->branch_name,
+            actual->branch_name);
+    return -1;
+  }
+  return 0;
+}
+
+/// Compares the state computed by promptsynth against git. Returns the
+/// number of mismatching fields.
+int compare_states(const ps_state* expected,
+                   const char* branch_oid,
+                   const ps_state* actual,
+                   const ps_state* refs_only) {
+  int failures = 0;
+  failures += check_branch(expected, branch_oid, actual) != 0;
+  failures += check_field("staged added", expected->staged.added,
+                          actual->staged.added) != 0;
+  failures += check_field("staged modified", expected->staged.modified,
+                          actual->staged.modified) != 0;
+  failures += check_field("staged deleted", expected->staged.deleted,
+                          actual->staged.deleted) != 0;
+  failures += check_field("unstaged added", expected->unstaged.added,
+                          actual->unstaged.added) != 0;
+  failures += check_field("unstaged modified", expected->unstaged.modified,
+                          actual->unstaged.modified) != 0;
+  failures += check_field("unstaged deleted", expected->unstaged.deleted,
+                          actual->unstaged.deleted) != 0;
+  failures += check_field("conflicted", expected->conflicted,
+                          actual->conflicted) != 0;
+  failures += check_field("has upstream", expected->has_upstream,
+                          actual->has_upstream) != 0;
+  failures +=
+      check_field("ahead", expected->ahead_by, actual->ahead_by) != 0;
+  failures +=
+      check_field("behind", expected->behind_by, actual->behind_by) != 0;
+  failures += check_field("stashes", expected->stashes, actual->stashes) != 0;
+  failures += check_operation("operation", expected, actual) != 0;
+
+  // the refs-only fast path must agree on everything it reports
+  failures += check_branch(expected, branch_oid, refs_only) != 0;
+  failures += check_field("refs-only has upstream", expected->has_upstream,
+                          refs_only->has_upstream) != 0;
+  failures += check_field("refs-only stashes", expected->stashes,
+                          refs_only->stashes) != 0;
+  failures += check_operation("refs-only operation", expected, refs_only) != 0;
+  if (refs_only->has_upstream && !refs_only->ahead_behind_unknown) {
+    failures += check_field("refs-only even with upstream", 0,
+                            expected->ahead_by + expected->behind_by) != 0;
+  }
+
+  // git diff shows combined diffs for unmerged paths, so only compare line
+  // counts without conflicts
+  if (expected->conflicted == 0) {
+    line_delta staged = read_git_numstat("git diff --cached --numstat");
+    line_delta unstaged = read_git_numstat("git diff --numstat");
+    failures += check_field("staged insertions", staged.insertions,
+                            actual->staged_lines.insertions) != 0;
+    failures += check_field("staged deletions", staged.deletions,
+                            actual->staged_lines.deletions) != 0;
+    failures += check_field("unstaged insertions", unstaged.insertions,
+                            actual->unstaged_lines.insertions) != 0;
+    failures += check_field("unstaged deletions", unstaged.deletions,
+                            actual->unstaged_lines.deletions) != 0;
+  }
+  return failures;
+}
+
+long elapsed_us(struct timespec* start, struct timespec* end) {
+  return (end->tv_sec - start->tv_sec) * 1000000L +
+         (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/// Runs one generated repository through `options->steps` mutations.
+/// Returns the number of divergent steps.
+int run_round(const difftest_options* options, unsigned long round_seed) {
+  unsigned long rng = round_seed;
+  ps_diffstat_limits limits = {.file_cap = 1 << 20, .total_cap = 64 << 20};
+  char cmd[CMD_BUF_SIZE], branch_oid[128];
+  int divergent = 0;
+
+  system("rm -rf " TEMP_DIR_NAME " && mkdir " TEMP_DIR_NAME);
+  chdir(TEMP_DIR_NAME);
+  if (setup_repo(&rng) != 0) {
+    fprintf(stderr, PR_YELLOW "setup failed for seed %lu" PR_RESET "\n",
+            round_seed);
+    chdir("..");
+    return 1;
+  }
+  for (int step = 0; step < options->steps; step++) {
+    ps_state expected, actual, refs_only;
+    const char* name = random_mutation(&rng, step, cmd);
+    run_command(cmd);
+    compute_repo_state_with_diffstat(".", &actual, &limits);
+    compute_refs_state(".", &refs_only);
+    if (read_git_status(&expected, branch_oid, sizeof(branch_oid)) != 0) {
+      fprintf(stderr, PR_YELLOW "git status failed at step %d" PR_RESET "\n",
+              step);
+      divergent++;
+      break;
+    }
+    if (compare_states(&expected, branch_oid, &actual, &refs_only) != 0) {
+      fprintf(stderr,
+              PR_RED "diverged at seed %lu, step %d (%s): %s" PR_RESET "\n",
+              round_seed, step, name, cmd);
+      divergent++;
+      break;  // later steps would only repeat the same difference
+    }
+  }
+  chdir("..");
+  system("rm -rf " TEMP_DIR_NAME);
+  return divergent;
+}
+
+/// Generates the latency repository: LATENCY_REPO_DIRS directories of
+/// LATENCY_REPO_FILES files, a few of them modified, deleted or untracked.
+int setup_latency_repo() {
+  char path[64];
+  if (run_command("git init -q && git checkout -q -b main") != 0) {
+    return -1;
+  }
+  for (int d = 0; d < LATENCY_REPO_DIRS; d++) {
+    snprintf(path, sizeof(path), "dir%d", d);
+    mkdir(path, 0755);
+    for (int f = 0; f < LATENCY_REPO_FILES; f++) {
+      snprintf(path, sizeof(path), "dir%d/file%d.txt", d, f);
+      FILE* fp = fopen(path, "w");
+      if (fp == NULL) {
+        return -1;
+      }
+      fprintf(fp, "%d\n%d\n", d, f);
+      fclose(fp);
+    }
+  }
+  const char* commands[] = {
+      "git add -A && git commit -q -m Initial",
+      "git branch base && git branch --set-upstream-to=base",
+      "for d in 0 10 20 30 40; do echo more >> dir$d/file1.txt; done",
+      "git rm -q dir50/file2.txt && echo new > dir60/untracked.txt",
+      // settle racily clean index entries, which would otherwise be hashed
+      // again on every run
+      "git status",
+  };
+  for (int i = 0; i < LEN(commands); i++) {
+    if (run_command(commands[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/// Times compute_repo_state against `git status` on the same repository and
+/// machine. Each pair of runs is back to back, so both see the same machine
+/// load, and the median of the per-pair ratios is returned, or a negative
+/// number on failure. The first pair only warms the caches.
+double measure_latency_ratio() {
+  double ratios[LATENCY_RUNS];
+  long ours_us = 0, git_us = 0;
+  double ratio = -1;
+  system("rm -rf " TEMP_DIR_NAME " && mkdir " TEMP_DIR_NAME);
+  chdir(TEMP_DIR_NAME);
+  if (setup_latency_repo() != 0) {
+    fprintf(stderr, PR_YELLOW "latency repo setup failed" PR_RESET "\n");
+    goto finish;
+  }
+  for (int i = -1; i < LATENCY_RUNS; i++) {
+    struct timespec start, end;
+    ps_state state = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    compute_repo_state(".", &state);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ours_us = elapsed_us(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (run_command(GIT_STATUS_REFERENCE) != 0) {
+      goto finish;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    git_us = elapsed_us(&start, &end);
+    if (i >= 0) {
+      ratios[i] = (double)ours_us / (git_us > 0 ? git_us : 1);
+    }
+  }
+  qsort(ratios, LATENCY_RUNS, sizeof(double), compare_doubles);
+  ratio = ratios[LATENCY_RUNS / 2];
+  fprintf(stderr,
+          "compute_repo_state %ldus, git status %ldus in the last run, "
+          "median ratio %.2f\n",
+          ours_us, git_us, ratio);
+finish:
+  chdir("..");
+  system("rm -rf " TEMP_DIR_NAME);
+  return ratio;
+}
+
+/// Compares the latency ratio with the baseline file, or records it with
+/// --record. The ratio to `git status` on the same machine is stored rather
+/// than a time, so that the baseline holds on faster or slower machines. A
+/// missing baseline is a failure, so that a typo in the path cannot
+/// silently turn the check off.
+int check_latency(const difftest_options* options, double ratio) {
+  double baseline = -1;
+  FILE* fp = fopen(options->baseline_file, "r");
+  if (fp != NULL) {
+    if (fscanf(fp, "compute_repo_state_vs_git_status %lf", &baseline) != 1) {
+      baseline = -1;
+    }
+    fclose(fp);
+  }
+  if (ratio < 0) {
+    return -1;
+  }
+  if (!options->record && baseline <= 0) {
+    fprintf(stderr,
+            PR_RED "No latency baseline in %s, run with --record to create "
+                   "it" PR_RESET "\n",
+            options->baseline_file);
+    return -1;
+  }
+  if (options->record) {
+    fp = fopen(options->baseline_file, "w");
+    if (fp == NULL) {
+      perror("cannot write latency baseline");
+      return -1;
+    }
+    fprintf(fp, "compute_repo_state_vs_git_status %.2f\n", ratio);
+    fclose(fp);
+    fprintf(stderr, "Recorded latency baseline %.2f in %s\n", ratio,
+            options->baseline_file);
+    return 0;
+  }
+  double limit = baseline * options->tolerance;
+  fprintf(stderr, "Latency ratio %.2f, baseline %.2f, limit %.2f\n", ratio,
+          baseline, limit);
+  return ratio <= limit ? 0 : -1;
+}
+
+void parse_args(int argc, char** argv, difftest_options* options) {
+  options->seed = (unsigned long)time(NULL);
+  options->rounds = 4;
+  options->steps = 40;
+  options->tolerance = 1.5;
+  options->baseline_file = "difftest_baseline.txt";
+  for (int i = 1; i < argc; i++) {
+    int has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--seed") == 0 && has_value) {
+      options->seed = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--rounds") == 0 && has_value) {
+      options->rounds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--steps") == 0 && has_value) {
+      options->steps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--baseline") == 0 && has_value) {
+      options->baseline_file = argv[++i];
+    } else if (strcmp(argv[i], "--tolerance") == 0 && has_value) {
+      options->tolerance = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--record") == 0) {
+      options->record = 1;
+    } else {
+      fprintf(stderr,
+              "usage: %s [--seed N] [--rounds N] [--steps N] "
+              "[--baseline FILE] [--tolerance X] [--record]\n",
+              argv[0]);
+      exit(2);
+    }
+  }
+  if (options->seed == 0) {
+    options->seed = 1;  // xorshift never leaves 0
+  }
+}
+
+int main(int argc, char** argv) {
+  difftest_options options = {0};
+  parse_args(argc, argv, &options);
+  int divergent_rounds = 0;
+
+  fprintf(stderr, PR_BLUE "Seed %lu, %d rounds of %d steps" PR_RESET "\n",
+          options.seed, options.rounds, options.steps);
+  git_libgit2_init();
+  for (int round = 0; round < options.rounds; round++) {
+    unsigned long round_seed = options.seed + round;
+    divergent_rounds += run_round(&options, round_seed) != 0;
+  }
+  int latency_result = check_latency(&options, measure_latency_ratio());
+  git_libgit2_shutdown();
+
+  fprintf(stderr,
+          PR_BLUE "Summary: DivergentRounds=" PR_RESET "%s%d" PR_RESET PR_BLUE
+                  ", Latency=" PR_RESET "%s" PR_RESET "\n",
+          divergent_rounds == 0 ? PR_GREEN : PR_RED, divergent_rounds,
+          latency_result == 0 ? PR_GREEN "OK" : PR_RED "Regressed");
+  return divergent_rounds == 0 && latency_result == 0 ? 0 : 1;
+}
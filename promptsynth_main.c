@@ -1,5 +1,9 @@
+#include <fcntl.h>
 #include <git2.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "promptsynth.h"
 
@@ -13,7 +17,8 @@
 #define STASH_FLAG "\u2691"
 
 typedef struct ps_options {
-  int use_bold_colors, show_stash;
+  int use_bold_colors, show_stash, refs_only, show_diffstat;
+  ps_diffstat_limits diffstat_limits;
   const char* branchname_color;
   const char* hash_color;
   const char* staged_color;
@@ -51,6 +56,12 @@ int get_env_int(const char* env_name, int fallback) {
 void init_options_from_env(ps_options* options) {
   options->use_bold_colors = get_env_int("PROMPTSYNTH_BOLD_COLORS", 0);
   options->show_stash = get_env_int("PROMPTSYNTH_SHOW_STASH", 0);
+  options->refs_only = get_env_int("PROMPTSYNTH_REFS_ONLY", 0);
+  options->show_diffstat = get_env_int("PROMPTSYNTH_SHOW_DIFFSTAT", 0);
+  options->diffstat_limits.file_cap =
+      get_env_int("PROMPTSYNTH_DIFFSTAT_FILE_CAP", 1 << 20);
+  options->diffstat_limits.total_cap =
+      get_env_int("PROMPTSYNTH_DIFFSTAT_TOTAL_CAP", 8 << 20);
   options->branchname_color =
       get_env_str("PROMPTSYNTH_BRANCHNAME_COLOR", ANSI_CYAN);
   options->hash_color = get_env_str("PROMPTSYNTH_HASH_COLOR", ANSI_CYAN);
@@ -68,6 +79,20 @@ void init_options_from_env(ps_options* options) {
   options->stash_symbol = get_env_str("PROMPTSYNTH_STASH_SYMBOL", STASH_FLAG);
 }
 
+/// Prints `+120 -45`, or `~` if the counts are incomplete.
+void print_line_delta(const char* color, line_delta* delta) {
+  if (delta->over_cap) {
+    printf(COLOR_PARAM "~" COLOR_RESET, color);
+  } else {
+    printf(COLOR_PARAM "+%d -%d" COLOR_RESET, color, delta->insertions,
+           delta->deletions);
+  }
+}
+
+int has_line_delta(line_delta* delta) {
+  return delta->insertions != 0 || delta->deletions != 0 || delta->over_cap;
+}
+
 void ps_print(ps_options* options, ps_state* state) {
   // TODO: Remote status
   // For ease of formatting
@@ -80,7 +105,7 @@ void ps_print(ps_options* options, ps_state* state) {
          state->branch_name);
 
   // if not local branch, print ahead-behind info
-  if (state->has_upstream) {
+  if (state->has_upstream && !state->ahead_behind_unknown) {
     if (state->ahead_by == 0 && state->behind_by == 0) {
       printf(" " CONGRUNET);
     } else {
@@ -94,6 +119,16 @@ void ps_print(ps_options* options, ps_state* state) {
     }
   }
 
+  // rebase, merge etc. in progress
+  if (state->conflict_type != NULL) {
+    printf(" %s " COLOR_PARAM "%s", options->seperator,
+           options->conflict_color, state->conflict_type);
+    if (state->operation_total != 0) {
+      printf(" %d/%d", state->operation_step, state->operation_total);
+    }
+    printf(COLOR_RESET);
+  }
+
   if (state->staged.added != 0 || state->staged.modified != 0 ||
       state->staged.deleted != 0) {
     printf(" %s " COLOR_PARAM "+%d ~%d -%d" COLOR_RESET, options->seperator,
@@ -106,6 +141,18 @@ void ps_print(ps_options* options, ps_state* state) {
            options->unstaged_color, state->unstaged.added,
            state->unstaged.modified, state->unstaged.deleted);
   }
+  if (state->has_diffstat && (has_line_delta(&state->staged_lines) ||
+                              has_line_delta(&state->unstaged_lines))) {
+    printf(" %s", options->seperator);
+    if (has_line_delta(&state->staged_lines)) {
+      printf(" ");
+      print_line_delta(options->staged_color, &state->staged_lines);
+    }
+    if (has_line_delta(&state->unstaged_lines)) {
+      printf(" ");
+      print_line_delta(options->unstaged_color, &state->unstaged_lines);
+    }
+  }
   if (state->conflicted != 0) {
     printf(" %s " COLOR_PARAM "%s%d" COLOR_RESET, options->seperator,
            options->conflict_color, options->conflict_symbol,
@@ -122,12 +169,43 @@ void ps_print(ps_options* options, ps_state* state) {
   fflush(stdout);
 }
 
+/// Warms caches for the next prompt in a detached child, see prefetch_repo.
+/// Meant for a `chpwd` hook, so the parent returns immediately.
+int prefetch_in_background() {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid < 0;
+  }
+  setsid();
+  int devnull = open("/dev/null", O_RDWR);
+  if (devnull >= 0) {
+    dup2(devnull, STDIN_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+  }
+  // PS_EBUSY means another prefetch is already warming this repository
+  int result = prefetch_repo(".");
+  _exit(result == 0 || result == PS_EBUSY ? 0 : 1);
+}
+
 int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--prefetch") == 0) {
+    return prefetch_in_background();
+  }
   ps_state state = {0};
   ps_options options = {0};
   init_options_from_env(&options);
+  if (options.refs_only) {
+    // branch, upstream and stash only; libgit2 is not needed at all
+    if (compute_refs_state(".", &state) == 0) {
+      ps_print(&options, &state);
+    }
+    return 0;
+  }
   git_libgit2_init();
-  int result = compute_repo_state(".", &state);
+  int result = compute_repo_state_with_diffstat(
+      ".", &state, options.show_diffstat ? &options.diffstat_limits : NULL);
   if (result == 0) {
     ps_print(&options, &state);
   }
@@ -0,0 +1,363 @@
+// readahead(2) is Linux specific
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "promptsynth.h"
+
+#define PREFETCH_MAX_THREADS 8
+// stop queueing directories after this many entries, e.g. in huge ignored
+// trees like node_modules
+#define PREFETCH_MAX_ENTRIES 500000
+#define PREFETCH_LOCK_FILE "promptsynth-prefetch.lock"
+// a finished prefetch is trusted for this long while the index is unchanged,
+// e.g. across `cd`s between subdirectories of the same repository
+#define PREFETCH_FRESH_SECONDS 300
+
+/// Asks the kernel to read a whole file into the page cache.
+void prefetch_file(const char* path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#if defined(__linux__)
+    readahead(fd, 0, st.st_size);
+#endif
+  }
+  close(fd);
+}
+
+void prefetch_in_dir(const char* dir, const char* name) {
+  char* path;
+  asprintf(&path, "%s/%s", dir, name);
+  prefetch_file(path);
+  free(path);
+}
+
+/// Pack indexes, the commit graph and the multi-pack index are what libgit2
+/// reads first when it looks up HEAD and runs ahead/behind.
+void prefetch_object_metadata(const char* commondir) {
+  char* pack_dir;
+  asprintf(&pack_dir, "%s/objects/pack", commondir);
+  DIR* dir = opendir(pack_dir);
+  if (dir != NULL) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      size_t len = strlen(entry->d_name);
+      if ((len > 4 && strcmp(entry->d_name + len - 4, ".idx") == 0) ||
+          strcmp(entry->d_name, "multi-pack-index") == 0) {
+        prefetch_in_dir(pack_dir, entry->d_name);
+      }
+    }
+    closedir(dir);
+  }
+  free(pack_dir);
+  prefetch_in_dir(commondir, "objects/info/commit-graph");
+}
+
+/// One line of an ignore file, e.g. `/build/` or `!node_modules`.
+typedef struct ignore_pattern {
+  char* pattern;
+  int anchored, negated;
+} ignore_pattern;
+
+typedef struct ignore_list {
+  ignore_pattern* patterns;
+  size_t count, capacity;
+} ignore_list;
+
+/// Adds the patterns of an ignore file which name a single path component,
+/// like `node_modules/`, `/build` or `*.egg-info`. Patterns with a slash
+/// inside, like `docs/build`, are not read, so those directories are walked.
+void load_ignore_file(ignore_list* ignores, const char* path) {
+  mapped_file mf;
+  if (map_file(path, &mf) != 0) {
+    return;
+  }
+  const char* line = mf.data;
+  const char* end = mf.data + mf.len;
+  while (line < end) {
+    const char* eol = memchr(line, '\n', end - line);
+    const char* next = eol != NULL ? eol + 1 : end;
+    if (eol == NULL) {
+      eol = end;
+    }
+    while (eol > line && (eol[-1] == '\r' || eol[-1] == ' ')) {
+      eol--;
+    }
+    ignore_pattern entry = {0};
+    if ((entry.negated = line < eol && *line == '!')) {
+      line++;
+    }
+    if (eol - line > 3 && memcmp(line, "**/", 3) == 0) {
+      line += 3;
+    } else if ((entry.anchored = line < eol && *line == '/')) {
+      line++;
+    }
+    if (eol > line && eol[-1] == '/') {
+      eol--;  // only directories are matched anyway
+    }
+    if (line < eol && *line != '#' && memchr(line, '/', eol - line) == NULL &&
+        memchr(line, '\\', eol - line) == NULL) {
+      if (ignores->count == ignores->capacity) {
+        ignores->capacity = ignores->capacity == 0 ? 16 : ignores->capacity * 2;
+        ignores->patterns = realloc(ignores->patterns,
+                                    ignores->capacity * sizeof(ignore_pattern));
+      }
+      entry.pattern = strndup(line, eol - line);
+      ignores->patterns[ignores->count++] = entry;
+    }
+    line = next;
+  }
+  unmap_file(&mf);
+}
+
+void free_ignore_list(ignore_list* ignores) {
+  for (size_t i = 0; i < ignores->count; i++) {
+    free(ignores->patterns[i].pattern);
+  }
+  free(ignores->patterns);
+}
+
+/// Like git, the last matching pattern decides, so `!name` re-includes it.
+int is_ignored_dir(const ignore_list* ignores, const char* name, int top) {
+  int ignored = 0;
+  for (size_t i = 0; i < ignores->count; i++) {
+    const ignore_pattern* entry = &ignores->patterns[i];
+    if ((top || !entry->anchored) && fnmatch(entry->pattern, name, 0) == 0) {
+      ignored = !entry->negated;
+    }
+  }
+  return ignored;
+}
+
+/// Directories still to be walked by the stat workers.
+typedef struct walk_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char** dirs;
+  size_t count, capacity;
+  int busy_workers;
+  long entries;
+  const char* workdir;
+  ignore_list ignores;
+} walk_queue;
+
+void queue_push(walk_queue* queue, char* dir) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == queue->capacity) {
+    queue->capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+    queue->dirs = realloc(queue->dirs, queue->capacity * sizeof(char*));
+  }
+  queue->dirs[queue->count++] = dir;
+  pthread_cond_signal(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/// Stats every entry of `dir`, so that its dentries and inodes are cached for
+/// the status walk, and queues subdirectories. Ignored directories are not
+/// entered, since the status walk only looks at tracked files in them.
+void walk_dir(walk_queue* queue, const char* dir) {
+  struct stat st;
+  int top = strcmp(dir, queue->workdir) == 0;
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* handle = fd < 0 ? NULL : fdopendir(fd);
+  if (handle == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  struct dirent* entry;
+  long seen = 0;
+  while ((entry = readdir(handle)) != NULL) {
+    const char* name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        strcmp(name, ".git") == 0) {
+      continue;
+    }
+    seen++;
+    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode) &&
+        __atomic_load_n(&queue->entries, __ATOMIC_RELAXED) <
+            PREFETCH_MAX_ENTRIES &&
+        !is_ignored_dir(&queue->ignores, name, top)) {
+      char* subdir;
+      asprintf(&subdir, "%s/%s", dir, name);
+      queue_push(queue, subdir);
+    } else if (S_ISREG(st.st_mode) && strcmp(name, ".gitignore") == 0) {
+      prefetch_in_dir(dir, name);
+    }
+  }
+  __atomic_add_fetch(&queue->entries, seen, __ATOMIC_RELAXED);
+  closedir(handle);
+}
+
+void* walk_worker(void* payload) {
+  walk_queue* queue = (walk_queue*)payload;
+  pthread_mutex_lock(&queue->lock);
+  for (;;) {
+    while (queue->count == 0 && queue->busy_workers > 0) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->count == 0) {
+      break;  // nothing queued and nobody can queue more
+    }
+    char* dir = queue->dirs[--queue->count];
+    queue->busy_workers++;
+    pthread_mutex_unlock(&queue->lock);
+
+    walk_dir(queue, dir);
+    free(dir);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->busy_workers--;
+  }
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+/// Walks the worktree with a few threads, since most of the cost of a cold
+/// walk is waiting on the disk for each directory. Only the top-level
+/// .gitignore and info/exclude are read for directories to skip.
+void prestat_worktree(const char* workdir, const char* commondir) {
+  walk_queue queue = {0};
+  char* path;
+  pthread_t threads[PREFETCH_MAX_THREADS];
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads < 1) {
+    n_threads = 1;
+  } else if (n_threads > PREFETCH_MAX_THREADS) {
+    n_threads = PREFETCH_MAX_THREADS;
+  }
+  asprintf(&path, "%s/.gitignore", workdir);
+  load_ignore_file(&queue.ignores, path);
+  free(path);
+  asprintf(&path, "%s/info/exclude", commondir);
+  load_ignore_file(&queue.ignores, path);
+  free(path);
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+  queue.workdir = workdir;
+  queue_push(&queue, strdup(workdir));
+
+  int started = 0;
+  for (; started < n_threads; started++) {
+    if (pthread_create(&threads[started], NULL, walk_worker, &queue) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    walk_worker(&queue);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(queue.dirs);
+  free_ignore_list(&queue.ignores);
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
+}
+
+/// The lock file is empty while a prefetch runs and holds its finish time
+/// afterwards. A prefetch which finished within PREFETCH_FRESH_SECONDS, with
+/// no index write since, has nothing left to warm.
+int prefetch_is_fresh(int lock_fd, const char* gitdir) {
+  struct stat lock_st, index_st;
+  char* index_path;
+  if (fstat(lock_fd, &lock_st) != 0 || lock_st.st_size == 0 ||
+      time(NULL) - lock_st.st_mtim.tv_sec > PREFETCH_FRESH_SECONDS) {
+    return 0;
+  }
+  asprintf(&index_path, "%s/index", gitdir);
+  int has_index = stat(index_path, &index_st) == 0;
+  free(index_path);
+  if (!has_index) {
+    return 1;
+  }
+  return index_st.st_mtim.tv_sec < lock_st.st_mtim.tv_sec ||
+         (index_st.st_mtim.tv_sec == lock_st.st_mtim.tv_sec &&
+          index_st.st_mtim.tv_nsec < lock_st.st_mtim.tv_nsec);
+}
+
+/// Truncates the lock file before a walk and writes the finish time after
+/// it, so that a killed prefetch is never taken for a finished one.
+int mark_prefetch(int lock_fd, int finished) {
+  char stamp[64];
+  struct timespec now;
+  if (ftruncate(lock_fd, 0) != 0) {
+    return -1;
+  }
+  if (!finished) {
+    return 0;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  int len = snprintf(stamp, sizeof(stamp), "%lld.%09ld\n",
+                     (long long)now.tv_sec, now.tv_nsec);
+  return pwrite(lock_fd, stamp, len, 0) == len ? 0 : -1;
+}
+
+/// prefetch_repo warms the page, dentry and inode caches for the repository
+/// containing `path`, so that the next compute_repo_state does not wait on
+/// the disk. It reads ahead the index, refs, config, ignore files and pack
+/// indexes, and stats the worktree outside of ignored directories. It does
+/// nothing if a prefetch finished recently and the index did not change
+/// since. Returns PS_ENOTAREPO if the path is not a git repo, and PS_EBUSY if
+/// another prefetch of the same repository is still running, e.g. after a
+/// quick series of `cd`s.
+int prefetch_repo(const char* path) {
+  ps_repo_paths paths;
+  char* lock_path;
+  if (discover_repo_paths(path, &paths) != 0) {
+    return PS_ENOTAREPO;
+  }
+  // flock is released when the process exits, so a killed prefetch never
+  // leaves a stale lock behind
+  asprintf(&lock_path, "%s/" PREFETCH_LOCK_FILE, paths.gitdir);
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  free(lock_path);
+  if (lock_fd >= 0 && flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    free_repo_paths(&paths);
+    return PS_EBUSY;
+  }
+  if (lock_fd >= 0 && prefetch_is_fresh(lock_fd, paths.gitdir)) {
+    close(lock_fd);
+    free_repo_paths(&paths);
+    return 0;
+  }
+  if (lock_fd >= 0) {
+    mark_prefetch(lock_fd, 0);
+  }
+  prefetch_in_dir(paths.gitdir, "index");
+  prefetch_in_dir(paths.gitdir, "HEAD");
+  prefetch_in_dir(paths.commondir, "config");
+  prefetch_in_dir(paths.commondir, "packed-refs");
+  prefetch_in_dir(paths.commondir, "info/exclude");
+  prefetch_object_metadata(paths.commondir);
+  if (paths.workdir != NULL) {
+    prestat_worktree(paths.workdir, paths.commondir);
+  }
+  if (lock_fd >= 0) {
+    mark_prefetch(lock_fd, 1);
+    close(lock_fd);
+  }
+  free_repo_paths(&paths);
+  return 0;
+}
@@ -1,10 +1,12 @@
 #include "promptsynth.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <git2.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <unistd.h>
 
 #define LEN(arr) (sizeof(arr) / sizeof(arr[0]))
@@ -337,6 +339,456 @@ finish:
   return result;
 }
 
+// -------------------------------------------------------
+int test_refs_only_state() {
+  const char* commands[] = {
+      "git init",
+      "git commit --allow-empty -m Commit1",
+      "git checkout -b feature",
+      "git branch base",
+      "git branch --set-upstream-to=base",
+      "git pack-refs --all",
+      "echo ABC > abc1",
+      "git add abc1 && git stash",
+  };
+  int result = TEST_SUCCESS;
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test
+  ps_state state = {0};
+  compute_refs_state(".", &state);
+  if (strcmp(state.branch_name, "feature") != 0) {
+    fprintf(stderr, "Expected branch_name = %s, got %s\n", "feature",
+            state.branch_name);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+  if (!state.has_upstream || state.ahead_behind_unknown) {
+    fprintf(stderr,
+            "Expected even upstream, got has_upstream=%d "
+            "ahead_behind_unknown=%d\n",
+            state.has_upstream, state.ahead_behind_unknown);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+  if (state.stashes != 1) {
+    fprintf(stderr, "Expected stashes = %d, got %d\n", 1, state.stashes);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int compare_line_deltas(const char* field_name,
+                        line_delta expected,
+                        line_delta actual) {
+  if (expected.insertions == actual.insertions &&
+      expected.deletions == actual.deletions &&
+      expected.over_cap == actual.over_cap) {
+    return 0;
+  }
+  fprintf(stderr, "%s: expected {+%d -%d cap=%d}, got {+%d -%d cap=%d}\n",
+          field_name, expected.insertions, expected.deletions,
+          expected.over_cap, actual.insertions, actual.deletions,
+          actual.over_cap);
+  return -1;
+}
+
+int test_diffstat() {
+  const char* commands[] = {
+      "git init",
+      "printf '1\\n2\\n3\\n' > append.txt",
+      "printf 'A\\nB\\n' > deleted.txt",
+      "git add append.txt deleted.txt",
+      "git commit -m Commit1",
+      "printf '1\\n2\\n3\\n4\\n5\\n' > append.txt",
+      "printf 'P\\nQ\\n' > new.txt",
+      "git add append.txt new.txt",
+      "printf '1\\nX\\n3\\n4\\n5\\n' > append.txt",
+      "rm deleted.txt",
+      "echo untracked > untracked.txt",
+  };
+  int result = TEST_SUCCESS;
+  ps_diffstat_limits limits = {.file_cap = 1 << 20, .total_cap = 1 << 20};
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test, twice so that the second run is answered from the cache
+  line_delta expected_staged = {.insertions = 4, .deletions = 0};
+  line_delta expected_unstaged = {.insertions = 1, .deletions = 3};
+  for (int i = 0; i < 2; i++) {
+    ps_state state = {0};
+    compute_repo_state_with_diffstat(".", &state, &limits);
+    if (compare_line_deltas("staged", expected_staged, state.staged_lines) !=
+            0 ||
+        compare_line_deltas("unstaged", expected_unstaged,
+                            state.unstaged_lines) != 0) {
+      result = TEST_FAILURE;
+      goto finish;
+    }
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int test_diffstat_over_cap() {
+  const char* commands[] = {
+      "git init",
+      "printf '1\\n2\\n3\\n' > grows.txt",
+      "cp grows.txt staged.txt",
+      "git add grows.txt staged.txt && git commit -m Commit1",
+      "seq 1 100 > staged.txt && git add staged.txt",
+      "seq 1 100 > grows.txt",
+      // old enough for its stat data to be a cache key
+      "touch -t 202001010000 grows.txt",
+  };
+  int result = TEST_SUCCESS;
+  ps_diffstat_limits limits = {.file_cap = 64, .total_cap = 1 << 20};
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test, a file over the cap must not be cached like a deleted one
+  line_delta expected_over_cap = {.over_cap = 1};
+  line_delta expected_deleted = {.insertions = 0, .deletions = 3};
+  ps_state state = {0};
+  compute_repo_state_with_diffstat(".", &state, &limits);
+  if (compare_line_deltas("over cap", expected_over_cap, state.staged_lines) !=
+          0 ||
+      compare_line_deltas("over cap", expected_over_cap,
+                          state.unstaged_lines) != 0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+  // raising the cap must not keep showing the cached `~`
+  line_delta expected_grown = {.insertions = 97, .deletions = 0};
+  limits.file_cap = 1 << 20;
+  for (int i = 0; i < 2; i++) {
+    memset((void*)&state, 0, sizeof(state));
+    compute_repo_state_with_diffstat(".", &state, &limits);
+    if (compare_line_deltas("grown", expected_grown, state.staged_lines) !=
+            0 ||
+        compare_line_deltas("grown", expected_grown, state.unstaged_lines) !=
+            0) {
+      result = TEST_FAILURE;
+      goto finish;
+    }
+  }
+  unlink("grows.txt");
+  memset((void*)&state, 0, sizeof(state));
+  compute_repo_state_with_diffstat(".", &state, &limits);
+  if (compare_line_deltas("deleted", expected_deleted, state.unstaged_lines) !=
+      0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int test_diffstat_autocrlf() {
+  const char* commands[] = {
+      "git init",
+      "git config core.autocrlf true",
+      "printf 'a\\r\\nb\\r\\n' > crlf.txt",
+      "git add crlf.txt && git commit -m Commit1",
+      "printf 'c\\r\\n' >> crlf.txt",
+  };
+  int result = TEST_SUCCESS;
+  ps_diffstat_limits limits = {.file_cap = 1 << 20, .total_cap = 1 << 20};
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test, only the appended line differs once end-of-lines are normalized
+  line_delta expected = {.insertions = 1, .deletions = 0};
+  ps_state state = {0};
+  compute_repo_state_with_diffstat(".", &state, &limits);
+  if (compare_line_deltas("unstaged", expected, state.unstaged_lines) != 0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int test_rewrite_is_not_rename() {
+  const char* commands[] = {
+      "git init",
+      "printf 'a1\\na2\\na3\\na4\\n' > a.txt",
+      "printf 'b1\\nb2\\nb3\\nb4\\n' > b.txt",
+      "git add a.txt b.txt",
+      "git commit -m Commit1",
+      "cp b.txt a.txt && rm b.txt && git add -A",
+  };
+  int result = TEST_SUCCESS;
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test, git status shows a modified a.txt and a deleted b.txt rather than
+  // a rename of b.txt, which only the line counts tell apart
+  file_triplet expected_staged = {.added = 0, .modified = 1, .deleted = 1};
+  line_delta expected_lines = {.insertions = 4, .deletions = 8};
+  ps_diffstat_limits limits = {.file_cap = 1 << 20, .total_cap = 1 << 20};
+  ps_state state = {0};
+  compute_repo_state_with_diffstat(".", &state, &limits);
+  if (compare_file_triplets("staged", expected_staged, state.staged) != 0 ||
+      compare_line_deltas("staged", expected_lines, state.staged_lines) != 0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int test_rebase_in_progress() {
+  const char* commands[] = {
+      "git init",
+      "echo base > conflict.txt",
+      "git add conflict.txt && git commit -m Base",
+      "git checkout -b topic",
+      "echo topic > conflict.txt && git commit -am Topic1",
+      "echo other > other.txt && git add other.txt && git commit -m Topic2",
+      "git checkout -",
+      "echo main > conflict.txt && git commit -am Main",
+      "git checkout topic",
+      "! git rebase -",
+  };
+  int result = TEST_SUCCESS;
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test
+  ps_state state = {0};
+  compute_repo_state(".", &state);
+  if (state.conflict_type == NULL ||
+      strcmp(state.conflict_type, "REBASE") != 0 ||
+      state.operation_step != 1 || state.operation_total != 2 ||
+      state.conflicted != 1) {
+    fprintf(stderr,
+            "Expected REBASE 1/2 with 1 conflict, got %s %d/%d with %d\n",
+            state.conflict_type, state.operation_step, state.operation_total,
+            state.conflicted);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+int expect_operation(const char* when, const char* expected) {
+  ps_state state = {0};
+  compute_repo_state(".", &state);
+  if (state.conflict_type == NULL ||
+      strcmp(state.conflict_type, expected) != 0) {
+    fprintf(stderr, "%s: expected %s, got %s\n", when, expected,
+            state.conflict_type != NULL ? state.conflict_type : "(none)");
+    return -1;
+  }
+  return 0;
+}
+
+int test_cherry_pick_in_progress() {
+  const char* commands[] = {
+      "git init",
+      "echo base > conflict.txt",
+      "git add conflict.txt && git commit -m Base",
+      "git checkout -b topic",
+      "echo topic > conflict.txt && git commit -am Topic1",
+      "echo other > other.txt && git add other.txt && git commit -m Topic2",
+      "git checkout -",
+      "echo main > conflict.txt && git commit -am Main",
+      "! git cherry-pick topic~1 topic",
+  };
+  const char* resolve[] = {
+      "echo resolved > conflict.txt && git add conflict.txt",
+      "git commit --no-edit",
+  };
+  int result = TEST_SUCCESS;
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test, the first step stops with CHERRY_PICK_HEAD
+  if (expect_operation("conflicted step", "CHERRY-PICKING") != 0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+  if (run_all_commands(resolve, LEN(resolve)) != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+  // once it is committed only sequencer/ tells that Topic2 is still to come
+  if (expect_operation("committed step", "CHERRY-PICKING") != 0) {
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
+// -------------------------------------------------------
+/// The finish time a prefetch leaves in its lock file.
+void read_prefetch_stamp(char* buf, size_t len) {
+  buf[0] = '\0';
+  FILE* fp = fopen(".git/promptsynth-prefetch.lock", "r");
+  if (fp != NULL) {
+    if (fgets(buf, len, fp) == NULL) {
+      buf[0] = '\0';
+    }
+    fclose(fp);
+  }
+}
+
+int test_prefetch() {
+  const char* commands[] = {
+      "git init",
+      "mkdir -p dir_1/dir_2 && echo ABC > dir_1/dir_2/abc.txt",
+      "echo '*.log' > .gitignore",
+      "git add . && git commit -m Commit1 && git gc -q",
+      "touch -t 202001010000 .git/index",
+  };
+  const char* change_index[] = {
+      "echo DEF > def.txt && git add def.txt",
+  };
+  char first_stamp[64], stamp[64];
+  int result = TEST_SUCCESS;
+
+  // setup
+  const char* tmp_dir = push_temp_dir();
+  int run_res = run_all_commands(commands, LEN(commands));
+  if (run_res != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+
+  // test
+  int prefetch_res = prefetch_repo("dir_1");
+  if (prefetch_res != 0) {
+    fprintf(stderr, "Expected prefetch to succeed, got %d\n", prefetch_res);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // with the index unchanged, e.g. after `cd dir_1`, there is nothing to do
+  read_prefetch_stamp(first_stamp, sizeof(first_stamp));
+  prefetch_res = prefetch_repo("dir_1/dir_2");
+  read_prefetch_stamp(stamp, sizeof(stamp));
+  if (prefetch_res != 0 || first_stamp[0] == '\0' ||
+      strcmp(first_stamp, stamp) != 0) {
+    fprintf(stderr, "Expected a fresh prefetch to be skipped, got %d %s %s\n",
+            prefetch_res, first_stamp, stamp);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // a changed index needs a new prefetch
+  if (run_all_commands(change_index, LEN(change_index)) != 0) {
+    result = SETUP_FAILURE;
+    goto finish;
+  }
+  prefetch_res = prefetch_repo(".");
+  read_prefetch_stamp(stamp, sizeof(stamp));
+  if (prefetch_res != 0 || strcmp(first_stamp, stamp) == 0) {
+    fprintf(stderr, "Expected a prefetch after the index changed, got %d %s\n",
+            prefetch_res, stamp);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // a second prefetch while one holds the lock must not start another walk
+  int lock_fd = open(".git/promptsynth-prefetch.lock", O_RDWR);
+  flock(lock_fd, LOCK_EX);
+  prefetch_res = prefetch_repo(".");
+  close(lock_fd);
+  if (prefetch_res != PS_EBUSY) {
+    fprintf(stderr, "Expected PS_EBUSY while locked, got %d\n", prefetch_res);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  prefetch_res = prefetch_repo("/tmp");
+  if (prefetch_res != PS_ENOTAREPO) {
+    fprintf(stderr, "Expected PS_ENOTAREPO outside a repo, got %d\n",
+            prefetch_res);
+    result = TEST_FAILURE;
+    goto finish;
+  }
+
+  // cleanup
+finish:
+  pop_tmp_dir(tmp_dir);
+  return result;
+}
+
 typedef int (*test_func)();
 
 typedef struct test_case {
@@ -355,6 +807,15 @@ int main(int argc, char** argv) {
       {.func = test_detached_head, .name = "Test detached head"},
       {.func = test_non_git_dir, .name = "Test non-git dir"},
       {.func = test_rename_detection, .name = "Test rename detection"},
+      {.func = test_rewrite_is_not_rename, .name = "Rewrite is not a rename"},
+      {.func = test_refs_only_state, .name = "Refs-only state"},
+      {.func = test_diffstat, .name = "Line diffstat"},
+      {.func = test_diffstat_over_cap, .name = "Line diffstat over cap"},
+      {.func = test_diffstat_autocrlf, .name = "Line diffstat with autocrlf"},
+      {.func = test_rebase_in_progress, .name = "Rebase in progress"},
+      {.func = test_cherry_pick_in_progress,
+       .name = "Cherry-pick in progress"},
+      {.func = test_prefetch, .name = "Prefetch"},
   };
   const char* legend[] = {"Passed", "Setup failure", "Test failure"};
   int counts[] = {0, 0, 0};